@@ -1,6 +1,18 @@
 BITS 16
 ORG 0x7C00
 
+; KERNEL_SECTORS is stamped in by the Makefile from the size of kernel.bin
+%ifndef KERNEL_SECTORS
+%error "KERNEL_SECTORS must be defined (see Makefile)"
+%endif
+%if KERNEL_SECTORS > 255
+%error "kernel.bin overlaps the filesystem at LBA 256"
+%endif
+
+KERNEL_SEGMENT equ 0x1000       ; kernel loads at 0x10000
+MAX_CHUNK equ 127               ; largest EDD transfer per call
+BOOT_TSC equ 0x1000             ; 64-bit TSC per boot phase, read by kernel_main
+
 start:
     xor ax, ax
     mov ds, ax
@@ -8,28 +20,71 @@ start:
     mov ss, ax
     mov sp, 0x7C00
 
+    rdtsc
+    mov [BOOT_TSC], eax
+    mov [BOOT_TSC + 4], edx
+
+    mov [boot_drive], dl
+
     mov si, msg_load
     call print_string
 
-    ; Load 33 sectors
-    mov ah, 0x02
-    mov al, 33          ; Load 33 sectors
-    mov ch, 0
-    mov cl, 2
-    mov dh, 0
-    mov dl, 0x80
-    mov bx, 0x1000
+    ; Check for INT 13h extensions (EDD)
+    mov ah, 0x41
+    mov bx, 0x55AA
+    mov dl, [boot_drive]
+    int 0x13
+    jc .no_lba
+    cmp bx, 0xAA55
+    jne .no_lba
+    test cx, 1
+    jz .no_lba
+
+    mov word [remaining], KERNEL_SECTORS
+
+.read_chunk:
+    mov ax, [remaining]
+    test ax, ax
+    jz .loaded
+    cmp ax, MAX_CHUNK
+    jbe .size_ok
+    mov ax, MAX_CHUNK
+.size_ok:
+    mov [dap_count], ax
+
+    mov si, dap
+    mov ah, 0x42
+    mov dl, [boot_drive]
     int 0x13
     jc .disk_error
 
-    jmp 0x0000:0x1000
+    ; Advance LBA and destination segment (512 / 16 = 32 paragraphs per sector)
+    mov ax, [dap_count]
+    sub [remaining], ax
+    add [dap_lba], ax
+    shl ax, 5
+    add [dap_segment], ax
+    jmp .read_chunk
+
+.loaded:
+    rdtsc
+    mov [BOOT_TSC + 8], eax
+    mov [BOOT_TSC + 12], edx
+
+    jmp KERNEL_SEGMENT:0x0000
+
+.no_lba:
+    mov si, msg_no_lba
+    call print_string
+    jmp .halt
 
 .disk_error:
     mov si, msg_error
     call print_string
+.halt:
     cli
     hlt
-    jmp $-1
+    jmp .halt
 
 print_string:
     lodsb
@@ -42,8 +97,25 @@ print_string:
 .done:
     ret
 
+; Disk address packet for INT 13h AH=42h
+dap:
+    db 0x10
+    db 0
+dap_count:
+    dw 0
+    dw 0x0000
+dap_segment:
+    dw KERNEL_SEGMENT
+dap_lba:
+    dd 1
+    dd 0
+
+boot_drive: db 0
+remaining: dw 0
+
 msg_load: db 'Loading VoxyOS...', 0x0D, 0x0A, 0
 msg_error: db 'Boot error!', 0x0D, 0x0A, 0
+msg_no_lba: db 'No LBA BIOS support!', 0x0D, 0x0A, 0
 
 times 510-($-$$) db 0
 dw 0xAA55
@@ -1,20 +1,176 @@
 BITS 16
 
+BOOT_TSC equ 0x1000
+E820_COUNT equ 0x1080
+E820_MAP equ 0x1100
+E820_MAX equ 64
+E820_SMAP equ 0x534D4150
+VBE_MODE equ 0x1700             ; mode set below | 0x4000, or 0 for text mode
+VBE_MODE_INFO equ 0x1800        ; its 256-byte ModeInfoBlock
+VBE_CONTROLLER_INFO equ 0x2000  ; 512-byte scratch for function 4F00h
+VBE_WIDTH equ 1024
+VBE_HEIGHT equ 768
+VBE_BPP equ 32
+VBE_ATTR_LFB equ 0x80
+VBE_MODE_LFB equ 0x4000
+MB1_MAGIC equ 0x1BADB002
+MB1_FLAGS equ 0x00000003        ; page-aligned modules, memory map
+MB2_MAGIC equ 0xE85250D6
+MB2_ARCH_I386 equ 0
+IDT_STUBS equ 64
+; Must match kernel.c
+SEL_KERNEL_DATA equ 0x10
+SEL_USER_CODE equ 0x1B
+SEL_USER_DATA equ 0x23
+SYSCALL_VECTOR equ 0x80
+SYS_NULL equ 0
+SYS_EXIT equ 1
+USER_BASE equ 0x40000000
+
+; GRAPHICS=0 (see Makefile) keeps the boot sector path in VGA text mode
+%ifndef GRAPHICS
+%define GRAPHICS 1
+%endif
+
 section .text
 global _start
 
 _start:
     cli
     
-    lgdt [gdt_descriptor]
+    ; boot.asm enters with _start at CS:0000, so address data relative to _start
+    mov ax, cs
+    mov ds, ax
+    
+    ; BIOS E820 memory map into the boot info page, 24 bytes per entry
+    xor ax, ax
+    mov es, ax
+    mov di, E820_MAP
+    xor ebx, ebx
+    xor bp, bp
+.e820_next:
+    mov eax, 0xE820
+    mov edx, E820_SMAP
+    mov ecx, 24
+    mov dword [es:di + 20], 1
+    int 0x15
+    jc .e820_done
+    cmp eax, E820_SMAP
+    jne .e820_done
+    test ecx, ecx
+    jz .e820_skip
+    add di, 24
+    inc bp
+    cmp bp, E820_MAX
+    jae .e820_done
+.e820_skip:
+    test ebx, ebx
+    jnz .e820_next
+.e820_done:
+    mov [es:E820_COUNT], bp
+    mov word [es:E820_COUNT + 2], 0
+    
+    ; VBE: find and set a VBE_WIDTH x VBE_HEIGHT x VBE_BPP mode with a linear
+    ; framebuffer. kernel_main keeps the 80x25 text console when there is none.
+    mov word [es:VBE_MODE], 0
+%if GRAPHICS
+    mov di, VBE_CONTROLLER_INFO
+    mov dword [es:di], 'VBE2'
+    mov ax, 0x4F00
+    int 0x10
+    cmp ax, 0x004F
+    jne .vbe_done
+    lfs si, [es:VBE_CONTROLLER_INFO + 14]   ; far pointer to the mode list
+.vbe_next:
+    mov cx, [fs:si]
+    add si, 2
+    cmp cx, 0xFFFF
+    je .vbe_done
+    push si
+    mov di, VBE_MODE_INFO
+    mov ax, 0x4F01
+    int 0x10
+    pop si
+    cmp ax, 0x004F
+    jne .vbe_next
+    test byte [es:VBE_MODE_INFO], VBE_ATTR_LFB
+    jz .vbe_next
+    cmp word [es:VBE_MODE_INFO + 18], VBE_WIDTH
+    jne .vbe_next
+    cmp word [es:VBE_MODE_INFO + 20], VBE_HEIGHT
+    jne .vbe_next
+    cmp byte [es:VBE_MODE_INFO + 25], VBE_BPP
+    jne .vbe_next
+    mov bx, cx
+    or bx, VBE_MODE_LFB
+    mov ax, 0x4F02
+    int 0x10
+    cmp ax, 0x004F
+    jne .vbe_done
+    mov [es:VBE_MODE], bx
+.vbe_done:
+%endif
+    
+    lgdt [gdt_descriptor - _start]
     
     mov eax, cr0
     or eax, 1
     mov cr0, eax
     
-    jmp 0x08:protected_mode
+    jmp dword 0x08:protected_mode
+
+; Multiboot headers for kernel-multiboot.elf. GRUB reads either one; QEMU's
+; -kernel loader only understands Multiboot1. Both must sit in the first
+; 8 KB of the image, so they follow the real-mode path.
+align 4
+multiboot1_header:
+    dd MB1_MAGIC
+    dd MB1_FLAGS
+    dd -(MB1_MAGIC + MB1_FLAGS)
+
+align 8
+multiboot2_header:
+    dd MB2_MAGIC
+    dd MB2_ARCH_I386
+    dd multiboot2_header_end - multiboot2_header
+    dd -(MB2_MAGIC + MB2_ARCH_I386 + (multiboot2_header_end - multiboot2_header))
+    dw 0                        ; end tag
+    dw 0
+    dd 8
+multiboot2_header_end:
 
 BITS 32
+; Multiboot loaders enter here already in protected mode, with the loader
+; magic in EAX and the boot information in EBX. Their GDT is not ours to
+; keep, and there are no boot sector timestamps, so the boot phases before
+; the kernel all read as zero.
+global multiboot_entry
+multiboot_entry:
+    cli
+    lgdt [gdt_descriptor]
+    jmp 0x08:.reload_segments
+.reload_segments:
+    mov cx, 0x10
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+    mov ss, cx
+    mov esp, 0x90000
+    
+    push ebx
+    push eax
+    extern multiboot_init
+    call multiboot_init
+    add esp, 8
+    
+    rdtsc
+    mov [BOOT_TSC], eax
+    mov [BOOT_TSC + 4], edx
+    mov [BOOT_TSC + 8], eax
+    mov [BOOT_TSC + 12], edx
+    jmp boot_tsc_entry
+
 protected_mode:
     mov ax, 0x10
     mov ds, ax
@@ -24,6 +180,11 @@ protected_mode:
     mov ss, ax
     mov esp, 0x90000
     
+    rdtsc
+boot_tsc_entry:
+    mov [BOOT_TSC + 16], eax
+    mov [BOOT_TSC + 20], edx
+    
     extern kernel_main
     call kernel_main
     
@@ -31,6 +192,259 @@ protected_mode:
     hlt
     jmp $
 
+; Interrupt stubs: vectors 0-31 are CPU exceptions, 32-47 the ISA IRQs and
+; 48-63 local APIC vectors (IPIs, spurious). Each stub pushes a uniform (int_no, err_code) pair and funnels into isr_common.
+%assign i 0
+%rep IDT_STUBS
+isr_stub_%+i:
+%if !(i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30)
+    push dword 0
+%endif
+    push dword i
+    jmp isr_common
+%assign i i+1
+%endrep
+
+; int 0x80 from ring 3. Its IDT entry is a trap gate, so system calls run
+; with interrupts on. The frame is isr_common's, handed to syscall_dispatch.
+extern syscall_dispatch
+global isr_syscall
+isr_syscall:
+    push dword 0
+    push dword SYSCALL_VECTOR
+    pushad
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, SEL_KERNEL_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    cld
+    push esp
+    call syscall_dispatch
+    jmp isr_return
+
+; Ring 3 may leave anything in the data segment registers, so they are saved
+; and the kernel's loaded for the C handler
+extern interrupt_dispatch
+isr_common:
+    pushad
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, SEL_KERNEL_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    cld
+    push esp
+    call interrupt_dispatch
+isr_return:
+    add esp, 4
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popad
+    add esp, 8
+    iret
+
+; SYSENTER arrives with interrupts off, CS and SS from the kernel selectors
+; and ESP on sysenter_stack.esp0 (MSR 0x175), a pointer to the TSS's esp0
+; field, so the first two loads switch to the kernel stack. User code passes its stack in ECX and its
+; return address in EDX. The frame built here matches an int 0x80 frame,
+; and SYSEXIT returns through the same two registers.
+global sysenter_entry
+sysenter_entry:
+    mov esp, [esp]
+    mov esp, [esp]
+    push dword SEL_USER_DATA
+    push ecx
+    pushfd
+    push dword SEL_USER_CODE
+    push edx
+    push dword 0
+    push dword SYSCALL_VECTOR
+    pushad
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, SEL_KERNEL_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    ; SYSENTER clears only IF and VM; TF, NT, DF and AC still hold ring 3's
+    push dword 2
+    popfd
+    sti
+    push esp
+    call syscall_dispatch
+    add esp, 4
+    cli
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popad
+    mov edx, [esp + 8]
+    mov ecx, [esp + 20]
+    ; The STI shadow covers SYSEXIT, so no interrupt lands on the user stack
+    sti
+    sysexit
+
+; int user_enter(unsigned int eip, unsigned int esp, unsigned int* kernel_esp)
+; Pushes the callee-saved registers, parks esp in *kernel_esp (the TSS's
+; esp0, where entries from ring 3 start) and irets to ring 3 with every
+; general register cleared. Returns the code user_exit() is given.
+global user_enter
+user_enter:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov eax, [esp + 28]
+    mov [eax], esp
+    mov eax, [esp + 20]
+    mov edx, [esp + 24]
+    push dword SEL_USER_DATA
+    push edx
+    push dword 0x202
+    push dword SEL_USER_CODE
+    push eax
+    mov ax, SEL_USER_DATA
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    iret
+
+; void user_exit(unsigned int kernel_esp, int code)
+; Drops whatever the kernel stack holds above kernel_esp and returns code
+; from user_enter. Faults reach here with interrupts off, so they go back on.
+global user_exit
+user_exit:
+    mov eax, [esp + 8]
+    mov esp, [esp + 4]
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    sti
+    ret
+
+; void context_switch(unsigned int* old_esp, unsigned int new_esp)
+; Pushes the callee-saved registers, parks esp in *old_esp and resumes the
+; thread whose stack was saved the same way (or built by thread_alloc)
+global context_switch
+context_switch:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; Application processor start-up code. smp_init() copies it to 0x8000 and
+; sends that page in the SIPI, so it starts in real mode at CS:0 and may only
+; address its own bytes relative to ap_trampoline. The far jump and the GDT
+; pointer hold linear kernel addresses, which stay valid after the copy.
+BITS 16
+global ap_trampoline
+global ap_trampoline_end
+ap_trampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    o32 lgdt [ap_gdt_pointer - ap_trampoline]
+    
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    
+    jmp dword 0x08:ap_protected_mode
+
+align 4
+ap_gdt_pointer:
+    dw gdt_end - gdt_start - 1
+    dd gdt_start
+ap_trampoline_end:
+
+BITS 32
+ap_protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    
+    extern ap_stack_top
+    mov esp, [ap_stack_top]
+    extern ap_main
+    call ap_main
+    
+    cli
+    hlt
+    jmp $
+
+; Ring 3 null system call loop for syscall_bench(), copied to USER_BASE and
+; started with [esp + 4] = calls and [esp + 8] = 1 for SYSENTER or 0 for
+; int 0x80. Position independent apart from the SYSENTER return address.
+global user_bench
+global user_bench_end
+user_bench:
+    mov ebp, [esp + 4]
+    cmp dword [esp + 8], 0
+    jne .sysenter
+.int80:
+    mov eax, SYS_NULL
+    int SYSCALL_VECTOR
+    dec ebp
+    jnz .int80
+    jmp .exit
+.sysenter:
+    mov eax, SYS_NULL
+    mov ecx, esp
+    mov edx, USER_BASE + .returned - user_bench
+    sysenter
+.returned:
+    dec ebp
+    jnz .sysenter
+.exit:
+    mov eax, SYS_EXIT
+    xor ebx, ebx
+    int SYSCALL_VECTOR
+user_bench_end:
+
+global isr_stub_table
+isr_stub_table:
+%assign i 0
+%rep IDT_STUBS
+    dd isr_stub_%+i
+%assign i i+1
+%endrep
+
 gdt_start:
     dq 0
     
@@ -47,6 +461,26 @@ gdt_start:
     db 10010010b
     db 11001111b
     db 0x00
+    
+    ; 0x18 and 0x20: the same flat code and data segments at DPL 3
+    dw 0xFFFF
+    dw 0x0000
+    db 0x00
+    db 11111010b
+    db 11001111b
+    db 0x00
+    
+    dw 0xFFFF
+    dw 0x0000
+    db 0x00
+    db 11110010b
+    db 11001111b
+    db 0x00
+    
+    ; 0x28: 32-bit TSS; user_init() fills in the base and limit
+global gdt_tss
+gdt_tss:
+    dq 0
 
 gdt_end:
 
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Compare a VoxyOS benchmark run against a stored baseline.
+
+Usage: tools/benchcmp.py bench.log baseline.txt [tolerance_percent]
+
+bench.log holds the "bench <name> <cycles>" lines `make bench` captures
+from QEMU's debug console. Without a baseline file the run is saved as the
+new baseline. Otherwise any workload more than tolerance_percent (default
+15) slower than the baseline fails the comparison with exit status 1.
+"""
+import os
+import re
+import sys
+
+
+def load_results(path):
+    results = {}
+    line_re = re.compile(r"^bench (\w+) (\d+)$")
+    with open(path, errors="replace") as f:
+        for line in f:
+            m = line_re.match(line.strip())
+            if m:
+                results[m.group(1)] = int(m.group(2))
+    return results
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__.strip())
+    results = load_results(sys.argv[1])
+    baseline_path = sys.argv[2]
+    tolerance = float(sys.argv[3]) if len(sys.argv) > 3 else 15.0
+    if not results:
+        sys.exit("no bench lines found in " + sys.argv[1])
+
+    if not os.path.exists(baseline_path):
+        with open(baseline_path, "w") as f:
+            for name, cycles in results.items():
+                f.write("bench %s %d\n" % (name, cycles))
+        print("no baseline, saved this run as " + baseline_path)
+        return
+
+    baseline = load_results(baseline_path)
+    failed = False
+    print("%-14s %14s %14s %8s" % ("workload", "baseline", "cycles", "change"))
+    for name, base in baseline.items():
+        if name not in results:
+            print("%-14s %14d %14s %8s  MISSING" % (name, base, "-", "-"))
+            failed = True
+            continue
+        cycles = results[name]
+        change = 100.0 * (cycles - base) / base if base else 0.0
+        verdict = ""
+        if change > tolerance:
+            verdict = "  REGRESSION"
+            failed = True
+        print("%-14s %14d %14d %+7.1f%%%s" % (name, base, cycles, change, verdict))
+    if failed:
+        sys.exit("benchmarks regressed by more than %g%%" % tolerance)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""Generate cmd_hash.h: a perfect hash over the shell command table.
+
+Usage: tools/cmdhash.py kernel.c > cmd_hash.h
+
+Reads the names from `static const struct command commands[]` in table
+order and searches for an FNV-1a seed under which the top CMD_HASH_BITS
+bits of every name's hash are distinct. command_lookup() in kernel.c
+must use the same hash.
+"""
+import re
+import sys
+
+
+def fnv1a(name, seed):
+    h = seed
+    for c in name.encode():
+        h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__.strip())
+    src = open(sys.argv[1]).read()
+    table = re.search(r"static const struct command commands\[\] = \{(.*?)\n\};", src, re.S)
+    if not table:
+        sys.exit("command table not found in " + sys.argv[1])
+    names = re.findall(r'^\s*\{\s*"([^"]+)"', table.group(1), re.M)
+    if len(set(names)) != len(names):
+        sys.exit("duplicate command names")
+
+    bits = max(1, (2 * len(names) - 1).bit_length())
+    for seed in range(0x811C9DC5, 0x811C9DC5 + (1 << 24)):
+        slots = [fnv1a(n, seed) >> (32 - bits) for n in names]
+        if len(set(slots)) == len(slots):
+            break
+    else:
+        sys.exit("no perfect hash seed found")
+
+    table = [-1] * (1 << bits)
+    for index, slot in enumerate(slots):
+        table[slot] = index
+
+    print("// Generated by tools/cmdhash.py from the command table in kernel.c")
+    print("#define CMD_HASH_SEED 0x%08Xu" % seed)
+    print("#define CMD_HASH_BITS %d" % bits)
+    print("#define CMD_HASH_COUNT %d" % len(names))
+    print("static const signed char cmd_hash_slots[%d] = {" % (1 << bits))
+    for i in range(0, len(table), 16):
+        print("    " + ", ".join("%2d" % v for v in table[i:i + 16]) + ",")
+    print("};")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+// Host-side microbenchmarks for the hardware-independent kernel code.
+//
+// Usage: make hostbench && ./hostbench [files] [file_size]
+//
+// kernel.c is compiled in whole with -DHOSTED, so the filesystem, block
+// cache, editor, timer wheel and string routines under test are the
+// kernel's own; only the disk (a RAM image), heap and console are shimmed.
+// Results use the "bench <name> <cycles>" lines of `make bench`, so
+// tools/benchcmp.py can compare two runs.
+#include "../kernel.c"
+
+#define HOSTBENCH_FILES 1000
+#define HOSTBENCH_FILE_SIZE 4096
+#define HOSTBENCH_EDITOR_CHARS (1024 * 1024)
+#define HOSTBENCH_TIMERS 10000
+
+static int hostbench_timers_fired;
+
+void hostbench_timer_fired(void* arg) {
+    (void)arg;
+    hostbench_timers_fired++;
+}
+
+int main(int argc, char** argv) {
+    int files = argc > 1 ? atoi(argv[1]) : HOSTBENCH_FILES;
+    int size = argc > 2 ? atoi(argv[2]) : HOSTBENCH_FILE_SIZE;
+    if (files < 1 || files > 1000 || size < 1 || size > MAX_FILE_SIZE) {
+        print_string("Usage: hostbench [files 1-1000] [file_size]\n");
+        return 2;
+    }
+
+    cpu_features_init();
+    clock_init();
+    cmd_buffer = kmalloc(CMD_BUFFER_SIZE);
+    if (fs_mount() < 0) {
+        print_string("[ERROR] Cannot mount the RAM disk\n");
+        return 1;
+    }
+
+    char* data = kmalloc(size);
+    char* buffer = kmalloc(size);
+    for (int i = 0; i < size; i++) data[i] = 'a' + i % 26;
+    char name[FILENAME_LEN];
+    int writes;
+    int failed = 0;
+
+    unsigned long long start = rdtsc();
+    for (int i = 0; i < files; i++) {
+        bench_file_name(name, i);
+        if (fs_save_file(name, data, size) != 0) failed = 1;
+    }
+    if (fs_sync(&writes) < 0) failed = 1;
+    bench_report("fs_save", rdtsc() - start, 0);
+
+    start = rdtsc();
+    for (int i = 0; i < files; i++) {
+        bench_file_name(name, i);
+        if (fs_find_file(name) < 0) failed = 1;
+    }
+    bench_report("fs_find", rdtsc() - start, 0);
+
+    start = rdtsc();
+    for (int i = 0; i < files; i++) {
+        bench_file_name(name, i);
+        if (fs_load_file(name, buffer, size) != size) failed = 1;
+    }
+    bench_report("fs_load", rdtsc() - start, 0);
+    if (memcmp(buffer, data, size) != 0) failed = 1;
+
+    // Streaming reads as cat does them, without the console
+    start = rdtsc();
+    for (int i = 0; i < files; i++) {
+        struct file_view view;
+        const char* chunk;
+        bench_file_name(name, i);
+        if (fs_view_open(&view, name) != 0) {
+            failed = 1;
+            continue;
+        }
+        int n;
+        while ((n = fs_view_map(&view, &chunk)) > 0) view.offset += n;
+        if (n < 0 || view.offset != size) failed = 1;
+        fs_view_close(&view);
+    }
+    bench_report("fs_view", rdtsc() - start, 0);
+
+    start = rdtsc();
+    for (int i = 0; i < files; i++) {
+        bench_file_name(name, i);
+        if (fs_delete_file(name) != 0) failed = 1;
+    }
+    if (fs_sync(&writes) < 0) failed = 1;
+    bench_report("fs_delete", rdtsc() - start, 0);
+
+    start = rdtsc();
+    for (int i = 0; i < HOSTBENCH_EDITOR_CHARS; i++) {
+        editor_insert(i % 64 == 63 ? '\n' : 'a' + i % 26);
+    }
+    bench_report("editor_insert", rdtsc() - start, 0);
+
+    start = rdtsc();
+    // Each move carries the whole document across the gap
+    for (int i = 0; i < 100; i++) {
+        editor_move_to(i & 1 ? 0 : HOSTBENCH_EDITOR_CHARS);
+    }
+    bench_report("editor_move", rdtsc() - start, 0);
+    if (editor_length() != HOSTBENCH_EDITOR_CHARS) failed = 1;
+    editor_release();
+
+    // Deadlines spread over 10 s, every other one cancelled, and the wheel
+    // stepped a millisecond at a time as the timer interrupt would
+    struct timer* timers = kmalloc(HOSTBENCH_TIMERS * sizeof(struct timer));
+    unsigned long long base = (timer_wheel_tick + 1) << TIMER_TICK_SHIFT;
+    start = rdtsc();
+    for (int i = 0; i < HOSTBENCH_TIMERS; i++) {
+        timers[i].fn = hostbench_timer_fired;
+        timers[i].pending = 0;
+        timer_add(&timers[i], base + (i * 7919ull % 10000) * 1000000);
+    }
+    for (int i = 0; i < HOSTBENCH_TIMERS; i += 2) {
+        if (!timer_cancel(&timers[i])) failed = 1;
+    }
+    for (int ms = 0; ms <= 10000; ms++) timer_run(base + ms * 1000000ull);
+    bench_report("timer_wheel", rdtsc() - start, 0);
+    if (hostbench_timers_fired != HOSTBENCH_TIMERS / 2) failed = 1;
+    kfree(timers);
+
+    cmd_membench("");
+
+    if (failed) {
+        print_string("[ERROR] A benchmark step failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,500 @@
+// Host-side unit tests for the hardware-independent kernel code.
+//
+// Usage: make test
+//
+// kernel.c is compiled in whole with -DHOSTED, as for tools/hostbench.c,
+// and each check compares a known input against a known output. The run
+// stops at the first failed check and exits non-zero.
+#include "../kernel.c"
+
+#define HOSTTEST_BUFFER 512
+#define HOSTTEST_FILE_SIZE 100000
+
+#define CHECK(cond) do { \
+    hosttest_checks++; \
+    if (!(cond)) { \
+        hosttest_fail(__LINE__, #cond); \
+        return 1; \
+    } \
+} while (0)
+
+static int hosttest_checks;
+
+void hosttest_fail(int line, const char* cond) {
+    print_string("[FAIL] tools/hosttest.c:");
+    print_number(line);
+    print_string(": ");
+    print_string(cond);
+    print_char('\n');
+}
+
+void hosttest_fill(unsigned char* buffer, int size) {
+    for (int i = 0; i < size; i++) buffer[i] = rand();
+}
+
+int test_atoi(void) {
+    CHECK(atoi("0") == 0);
+    CHECK(atoi("42") == 42);
+    CHECK(atoi("007") == 7);
+    CHECK(atoi("2147483647") == 2147483647);
+    CHECK(atoi("   123") == 123);
+    CHECK(atoi("12abc") == 12);
+    CHECK(atoi("12 34") == 12);
+    CHECK(atoi("abc") == 0);
+    CHECK(atoi("") == 0);
+    // No sign is accepted: callers only take counts, rates and sizes
+    CHECK(atoi("-5") == 0);
+    CHECK(atoi("+5") == 0);
+    return 0;
+}
+
+int test_scancodes(void) {
+    CHECK(scancode_to_ascii(0x1E) == 'a');
+    CHECK(scancode_to_ascii(0x10) == 'q');
+    CHECK(scancode_to_ascii(0x02) == '1');
+    CHECK(scancode_to_ascii(0x0B) == '0');
+    CHECK(scancode_to_ascii(0x1C) == '\n');
+    CHECK(scancode_to_ascii(0x0E) == '\b');
+    CHECK(scancode_to_ascii(0x0F) == '\t');
+    CHECK(scancode_to_ascii(0x35) == '/');
+    CHECK(scancode_to_ascii(0x39) == ' ');
+    CHECK(scancode_to_ascii(KEY_ESC) == 0);
+    CHECK(scancode_to_ascii(KEY_LSHIFT) == 0);
+    CHECK(scancode_to_ascii(KEY_RSHIFT) == 0);
+    CHECK(scancode_to_ascii(0x3A) == 0);
+    CHECK(scancode_to_ascii(0x7F) == 0);
+    CHECK(scancode_to_ascii(0x9E) == 0);
+    CHECK(scancode_to_ascii(KEY_PGUP) == 0);
+    CHECK(scancode_to_ascii(0xFF) == 0);
+    CHECK(ascii_to_scancode('a') == 0x1E);
+    CHECK(ascii_to_scancode('A') == 0x1E);
+    CHECK(ascii_to_scancode('\r') == 0x1C);
+    CHECK(ascii_to_scancode(0x7F) == 0x0E);
+    CHECK(ascii_to_scancode('~') == 0);
+
+    // Shift state lives in getkey(): make and break codes of either shift
+    // key toggle it and are swallowed, like every other break code
+    keyboard_push(KEY_LSHIFT);
+    keyboard_push(0x1E);
+    CHECK(getkey() == 0x1E);
+    CHECK(keyboard_shift);
+    keyboard_push(0x9E);
+    keyboard_push(KEY_LSHIFT | 0x80);
+    keyboard_push(0x30);
+    CHECK(getkey() == 0x30);
+    CHECK(!keyboard_shift);
+    keyboard_push(KEY_RSHIFT);
+    keyboard_push(0xE0);
+    keyboard_push(0x49);
+    CHECK(getkey() == KEY_PGUP);
+    CHECK(keyboard_shift);
+    // E0 2A is the fake shift sent around grey keys: an extended key with
+    // no character, not a shift press
+    keyboard_push(KEY_RSHIFT | 0x80);
+    keyboard_push(0xE0);
+    keyboard_push(KEY_LSHIFT);
+    keyboard_push(0x1F);
+    CHECK(getkey() == (KEY_EXTENDED | KEY_LSHIFT));
+    CHECK(!keyboard_shift);
+    CHECK(getkey() == 0x1F);
+    return 0;
+}
+
+// Every variant against a plain loop, at each size and alignment up to 64
+int test_strings(void) {
+    static unsigned char a[HOSTTEST_BUFFER];
+    static unsigned char b[HOSTTEST_BUFFER];
+    static unsigned char want[HOSTTEST_BUFFER];
+    void* (*copies[])(void*, const void*, unsigned int) = { memcpy_byte, memcpy_movsd, memcpy_erms, memcpy_sse2, memcpy };
+    void* (*sets[])(void*, int, unsigned int) = { memset_byte, memset_stosd, memset_sse2, memset };
+    int (*compares[])(const void*, const void*, unsigned int) = { memcmp_byte, memcmp_word, memcmp_sse2, memcmp };
+    int (*lengths[])(const char*) = { strlen_byte, strlen_word, strlen_sse2, strlen };
+    void* (*finds[])(const void*, int, unsigned int) = { memchr_byte, memchr_word, memchr_sse2, memchr };
+    // The SSE2 variants sit third in each list but the copies
+    int copy_sse2 = 3;
+    int other_sse2 = 2;
+
+    for (int align = 0; align < 16; align++) {
+        for (int n = 0; n <= 200; n += n < 64 ? 1 : 17) {
+            for (int v = 0; v < 5; v++) {
+                if (v == copy_sse2 && !cpu_has_sse2) continue;
+                hosttest_fill(a, HOSTTEST_BUFFER);
+                hosttest_fill(b, HOSTTEST_BUFFER);
+                for (int i = 0; i < HOSTTEST_BUFFER; i++) want[i] = b[i];
+                for (int i = 0; i < n; i++) want[align + 3 + i] = a[align + i];
+                CHECK(copies[v](b + align + 3, a + align, n) == b + align + 3);
+                CHECK(memcmp_byte(b, want, HOSTTEST_BUFFER) == 0);
+            }
+            for (int v = 0; v < 4; v++) {
+                if (v == other_sse2 && !cpu_has_sse2) continue;
+                hosttest_fill(b, HOSTTEST_BUFFER);
+                for (int i = 0; i < HOSTTEST_BUFFER; i++) want[i] = i >= align && i < align + n ? 0xC3 : b[i];
+                CHECK(sets[v](b + align, 0x1C3, n) == b + align);
+                CHECK(memcmp_byte(b, want, HOSTTEST_BUFFER) == 0);
+
+                hosttest_fill(a, HOSTTEST_BUFFER);
+                for (int i = 0; i < HOSTTEST_BUFFER; i++) b[i] = a[i];
+                CHECK(compares[v](a + align, b + align, n) == 0);
+                if (n) {
+                    int at = (align * 7 + n) % n;
+                    a[align + at] = 0x01;
+                    b[align + at] = 0xFF;
+                    CHECK(compares[v](a + align, b + align, n) < 0);
+                    CHECK(compares[v](b + align, a + align, n) > 0);
+                    // Bytes past n never count
+                    CHECK(compares[v](a + align, b + align, at) == 0);
+                }
+
+                for (int i = 0; i < HOSTTEST_BUFFER; i++) a[i] = 'a' + i % 26;
+                a[align + n] = 0;
+                CHECK(lengths[v]((const char*)a + align) == n);
+
+                for (int i = 0; i < HOSTTEST_BUFFER; i++) a[i] = i % 0x80;
+                CHECK(finds[v](a + align, 0xC3, n) == 0);
+                if (n) {
+                    a[align + n - 1] = 0xC3;
+                    CHECK(finds[v](a + align, 0xC3, n) == a + align + n - 1);
+                    a[align + n / 2] = 0xC3;
+                    CHECK(finds[v](a + align, 0x1C3, n) == a + align + n / 2);
+                    CHECK(finds[v](a + align, 0xC3, n / 2) == 0);
+                }
+            }
+        }
+    }
+
+    // memmove against a copy through a separate buffer, for sources on
+    // either side of the destination and overlapping it or not
+    for (int n = 0; n <= 160; n += 1 + n / 8) {
+        for (int shift = -40; shift <= 40; shift++) {
+            hosttest_fill(a, HOSTTEST_BUFFER);
+            int src = 200;
+            int dest = src + shift;
+            for (int i = 0; i < HOSTTEST_BUFFER; i++) want[i] = a[i];
+            for (int i = 0; i < n; i++) b[i] = a[src + i];
+            for (int i = 0; i < n; i++) want[dest + i] = b[i];
+            CHECK(memmove(a + dest, a + src, n) == a + dest);
+            CHECK(memcmp_byte(a, want, HOSTTEST_BUFFER) == 0);
+        }
+    }
+
+    char text[16];
+    strcpy(text, "voxy");
+    CHECK(strlen(text) == 4);
+    CHECK(strcmp(text, "voxy") == 0);
+    CHECK(strcmp(text, "voxx") > 0);
+    CHECK(strcmp(text, "voxyos") < 0);
+    CHECK(strcmp("", "") == 0);
+    CHECK(strcmp("\xFF", "a") > 0);
+    return 0;
+}
+
+int test_lz4(void) {
+    static char input[HOSTTEST_FILE_SIZE];
+    static char packed[HOSTTEST_FILE_SIZE + HOSTTEST_FILE_SIZE / 255 + 16];
+    static char output[HOSTTEST_FILE_SIZE + 16];
+    int sizes[] = { 0, 1, 12, 13, 100, 4096, 65535, 65536, HOSTTEST_FILE_SIZE };
+
+    for (int kind = 0; kind < 3; kind++) {
+        for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            int size = sizes[s];
+            for (int i = 0; i < size; i++) {
+                input[i] = kind == 0 ? 'a' + i % 7 : kind == 1 ? "the quick brown fox "[i % 20] + i / 4000 : (char)rand();
+            }
+            int packed_size = lz4_compress(input, size, packed, sizeof(packed));
+            CHECK(packed_size > 0 || size == 0);
+            if (kind < 2 && size >= 4096) CHECK(packed_size < size / 4);
+            memset(output, 0x5A, sizeof(output));
+            CHECK(lz4_decompress(packed, packed_size, output, size) == size);
+            CHECK(memcmp(output, input, size) == 0);
+            // Nothing is written past limit, even by the 8-byte copies
+            for (int i = size; i < size + 16; i++) CHECK(output[i] == 0x5A);
+            if (size > 1) CHECK(lz4_decompress(packed, packed_size, output, size - 1) == -1);
+        }
+    }
+
+    // Random data cannot shrink, so it does not fit in its own size
+    hosttest_fill((unsigned char*)input, 4096);
+    CHECK(lz4_compress(input, 4096, packed, 4096) == -1);
+
+    // Three literals, a 9-byte match 3 back, then five last literals
+    const char block[] = { 0x35, 'a', 'b', 'c', 3, 0, 0x50, 'x', 'y', 'z', 'w', '!' };
+    CHECK(lz4_decompress(block, sizeof(block), output, 64) == 17);
+    CHECK(memcmp(output, "abcabcabcabcxyzw!", 17) == 0);
+    // A zero offset, an offset before the output and a cut-off block
+    const char zero_offset[] = { 0x35, 'a', 'b', 'c', 0, 0, 0x00 };
+    const char far_offset[] = { 0x35, 'a', 'b', 'c', 4, 0, 0x00 };
+    CHECK(lz4_decompress(zero_offset, sizeof(zero_offset), output, 64) == -1);
+    CHECK(lz4_decompress(far_offset, sizeof(far_offset), output, 64) == -1);
+    CHECK(lz4_decompress(block, 5, output, 64) == -1);
+    return 0;
+}
+
+// Saves three files, one of them left uncompressed, and checks them again
+// after a sync and a fresh mount of the RAM disk
+int test_fs(void) {
+    static char data[HOSTTEST_FILE_SIZE];
+    static char random[HOSTTEST_FILE_SIZE / 4];
+    static char buffer[HOSTTEST_FILE_SIZE];
+    for (int i = 0; i < HOSTTEST_FILE_SIZE; i++) data[i] = "VoxyOS filesystem\n"[i % 18];
+    hosttest_fill((unsigned char*)random, sizeof(random));
+
+    // The RAM disk refuses transfers that run off its end
+    unsigned char* sector = (unsigned char*)buffer;
+    CHECK(ata_read(HOSTED_DISK_SECTORS - 1, 2, sector) == -1);
+    CHECK(ata_write(HOSTED_DISK_SECTORS, 1, &sector) == -1);
+
+    CHECK(fs_mount() == 1);
+    CHECK(fs_save_file("notes.txt", "hello", 5) == 0);
+    CHECK(fs_save_file("big.txt", data, HOSTTEST_FILE_SIZE) == 0);
+    CHECK(fs_save_file("random.bin", random, sizeof(random)) == 0);
+    CHECK(fs_save_file("empty.txt", "", 0) == 0);
+    CHECK(fs_save_file("notes.txt", "hello again", 11) == 0);
+    CHECK(fs_save_file("a_name_too_long.txt", "x", 1) == -1);
+    CHECK(fs_save_file("huge.bin", data, MAX_FILE_SIZE + 1) == -1);
+
+    struct file_view view;
+    CHECK(fs_view_open(&view, "big.txt") == 0);
+    CHECK(view.stored != 0);
+    fs_view_close(&view);
+    CHECK(fs_view_open(&view, "random.bin") == 0);
+    CHECK(view.stored == 0);
+    fs_view_close(&view);
+
+    for (int pass = 0; pass < 2; pass++) {
+        CHECK(fs_load_file("notes.txt", buffer, HOSTTEST_FILE_SIZE) == 11);
+        CHECK(memcmp(buffer, "hello again", 11) == 0);
+        CHECK(fs_load_file("big.txt", buffer, HOSTTEST_FILE_SIZE) == HOSTTEST_FILE_SIZE);
+        CHECK(memcmp(buffer, data, HOSTTEST_FILE_SIZE) == 0);
+        CHECK(fs_load_file("big.txt", buffer, 1000) == 1000);
+        CHECK(memcmp(buffer, data, 1000) == 0);
+        CHECK(fs_load_file("random.bin", buffer, HOSTTEST_FILE_SIZE) == (int)sizeof(random));
+        CHECK(memcmp(buffer, random, sizeof(random)) == 0);
+        CHECK(fs_load_file("empty.txt", buffer, HOSTTEST_FILE_SIZE) == 0);
+        CHECK(fs_file_size("big.txt") == HOSTTEST_FILE_SIZE);
+        if (pass == 0) {
+            CHECK(fs_delete_file("random.bin") == 0);
+            CHECK(fs_delete_file("random.bin") == -1);
+            CHECK(fs_save_file("random.bin", random, sizeof(random)) == 0);
+        }
+
+        int writes;
+        CHECK(fs_sync(&writes) >= 0);
+        fs_mounted = 0;
+        CHECK(fs_mount() == 0);
+    }
+
+    CHECK(fs_delete_file("random.bin") == 0);
+    CHECK(fs_delete_file("big.txt") == 0);
+    CHECK(fs_load_file("big.txt", buffer, HOSTTEST_FILE_SIZE) == -1);
+    CHECK(fs_load_file("missing.txt", buffer, HOSTTEST_FILE_SIZE) == -1);
+    CHECK(fs_delete_file("missing.txt") == -1);
+    int writes;
+    CHECK(fs_sync(&writes) >= 0);
+    fs_mounted = 0;
+    CHECK(fs_mount() == 0);
+    CHECK(fs_find_file("big.txt") == -1);
+    CHECK(fs_load_file("notes.txt", buffer, HOSTTEST_FILE_SIZE) == 11);
+
+    // bench refuses to run over a user file with one of its names
+    CHECK(fs_save_file("bench005.tmp", "mine", 4) == 0);
+    console_quiet = 1;
+    cmd_bench("");
+    console_quiet = 0;
+    CHECK(fs_load_file("bench005.tmp", buffer, HOSTTEST_FILE_SIZE) == 4);
+    CHECK(memcmp(buffer, "mine", 4) == 0);
+    CHECK(fs_find_file("bench000.tmp") == -1);
+    CHECK(fs_delete_file("bench005.tmp") == 0);
+    return 0;
+}
+
+// Snapshots share blocks with the live directory: a restore brings back
+// the snapshot's files across a remount, and once every snapshot is gone
+// the blocks they held are free again
+int test_snap(void) {
+    static char data[HOSTTEST_FILE_SIZE];
+    static char buffer[HOSTTEST_FILE_SIZE];
+    for (int i = 0; i < HOSTTEST_FILE_SIZE; i++) data[i] = "snapshot "[i % 9];
+
+    CHECK(fs_save_file("keep.txt", data, HOSTTEST_FILE_SIZE) == 0);
+    CHECK(fs_save_file("edit.txt", "before", 6) == 0);
+    unsigned int baseline = fs_super.free_blocks;
+    CHECK(fs_snap_create("one") == 0);
+    CHECK(fs_snap_create("one") == -1);
+    // The first snapshot also gives the records and the live map their blocks
+    unsigned int records = 1 + fs_map_blocks();
+
+    CHECK(fs_save_file("edit.txt", "after", 5) == 0);
+    CHECK(fs_delete_file("keep.txt") == 0);
+    CHECK(fs_save_file("new.txt", "new", 3) == 0);
+    CHECK(fs_snap_create("two") == 0);
+    CHECK(fs_snap_restore("one") == 0);
+
+    int writes;
+    CHECK(fs_sync(&writes) >= 0);
+    fs_mounted = 0;
+    CHECK(fs_mount() == 0);
+    CHECK(fs_load_file("keep.txt", buffer, HOSTTEST_FILE_SIZE) == HOSTTEST_FILE_SIZE);
+    CHECK(memcmp(buffer, data, HOSTTEST_FILE_SIZE) == 0);
+    CHECK(fs_load_file("edit.txt", buffer, HOSTTEST_FILE_SIZE) == 6);
+    CHECK(memcmp(buffer, "before", 6) == 0);
+    CHECK(fs_find_file("new.txt") == -1);
+
+    CHECK(fs_snap_restore("two") == 0);
+    CHECK(fs_load_file("edit.txt", buffer, HOSTTEST_FILE_SIZE) == 5);
+    CHECK(memcmp(buffer, "after", 5) == 0);
+    CHECK(fs_load_file("new.txt", buffer, HOSTTEST_FILE_SIZE) == 3);
+    CHECK(fs_find_file("keep.txt") == -1);
+    CHECK(fs_snap_restore("one") == 0);
+
+    CHECK(fs_snap_delete("one") == 0);
+    CHECK(fs_snap_delete("two") == 0);
+    CHECK(fs_snap_delete("two") == -1);
+    CHECK(fs_super.free_blocks == baseline - records);
+    CHECK(fs_load_file("keep.txt", buffer, HOSTTEST_FILE_SIZE) == HOSTTEST_FILE_SIZE);
+    CHECK(memcmp(buffer, data, HOSTTEST_FILE_SIZE) == 0);
+    CHECK(fs_delete_file("keep.txt") == 0);
+    CHECK(fs_delete_file("edit.txt") == 0);
+
+    // A remount onto a disk with a different inode count rebuilds the index
+    // at the new size
+    unsigned int sizes[] = { fs_super.total_blocks / 4, fs_super.total_blocks };
+    for (int i = 0; i < 2; i++) {
+        CHECK(fs_format(sizes[i]) == 0);
+        fs_mounted = 0;
+        CHECK(fs_mount() == 0);
+        CHECK(fs_index_inodes == fs_super.inode_count);
+        CHECK(fs_save_file("edit.txt", "again", 5) == 0);
+        CHECK(fs_load_file("edit.txt", buffer, HOSTTEST_FILE_SIZE) == 5);
+    }
+    return 0;
+}
+
+int hosttest_editor_is(const char* text) {
+    int len = strlen(text);
+    if (editor_length() != len) return 0;
+    for (int i = 0; i < len; i++) {
+        if (editor_char(i) != text[i]) return 0;
+    }
+    return 1;
+}
+
+int test_editor(void) {
+    editor_release();
+    editor_line = 0;
+    const char* text = "hello\nworld";
+    for (int i = 0; text[i]; i++) editor_insert(text[i]);
+    CHECK(hosttest_editor_is("hello\nworld"));
+    CHECK(editor_gap_start == 11);
+    CHECK(editor_line == 1);
+
+    editor_move_to(5);
+    CHECK(editor_line == 0);
+    editor_insert(',');
+    CHECK(hosttest_editor_is("hello,\nworld"));
+    editor_move_to(0);
+    editor_delete();
+    CHECK(hosttest_editor_is("ello,\nworld"));
+    editor_backspace();
+    CHECK(hosttest_editor_is("ello,\nworld"));
+    editor_move_to(editor_length());
+    CHECK(editor_line == 1);
+    editor_backspace();
+    editor_delete();
+    CHECK(hosttest_editor_is("ello,\nworl"));
+    editor_move_to(6);
+    CHECK(editor_line == 1);
+    editor_backspace();
+    CHECK(editor_line == 0);
+    CHECK(hosttest_editor_is("ello,worl"));
+    editor_insert('\n');
+    editor_insert('\n');
+    CHECK(editor_line == 2);
+    CHECK(hosttest_editor_is("ello,\n\nworl"));
+
+    // Column kept across a shorter line
+    editor_move_to(3);
+    editor_move_lines(2);
+    CHECK(editor_gap_start == 10);
+    CHECK(editor_line == 2);
+    editor_move_lines(-1);
+    CHECK(editor_gap_start == 6);
+    CHECK(editor_line_start(9) == 7);
+    CHECK(editor_line_end(0) == 5);
+
+    // Growing the gap keeps the text on both sides of it
+    editor_move_to(5);
+    for (int i = 0; i < 20000; i++) editor_insert('0' + i % 10);
+    CHECK(editor_length() == 20011);
+    CHECK(editor_char(4) == ',' && editor_char(5) == '0' && editor_char(20004) == '9');
+    CHECK(editor_char(20005) == '\n' && editor_char(20010) == 'l');
+    editor_move_to(0);
+    editor_move_to(editor_length());
+    CHECK(editor_line == 2);
+    for (int i = 0; i < 20011; i++) editor_backspace();
+    CHECK(editor_length() == 0);
+    CHECK(editor_line == 0);
+    editor_release();
+    return 0;
+}
+
+static struct timer hosttest_timer;
+static unsigned long long hosttest_now;
+static int hosttest_fired;
+
+// Re-arms 50 ms after the late interrupt that ran it, like a scheduler
+// slice, which can land a full turn of level 0 ahead in the same slot
+void hosttest_rearm(void* arg) {
+    (void)arg;
+    hosttest_fired++;
+    timer_add(&hosttest_timer, hosttest_now + 50000000);
+}
+
+int test_timer(void) {
+    unsigned long long expires = (timer_wheel_tick + 10) << TIMER_TICK_SHIFT;
+    hosttest_now = expires - (1 << TIMER_TICK_SHIFT);
+    hosttest_timer.fn = hosttest_rearm;
+    hosttest_timer.pending = 0;
+    timer_add(&hosttest_timer, expires);
+
+    // Each step skips about 16 ticks, as a long stretch with interrupts
+    // off would
+    int fired = 0;
+    for (int step = 0; step < 100; step++) {
+        hosttest_now += 17000000;
+        unsigned long long due = (expires + (1 << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+        if (due <= hosttest_now >> TIMER_TICK_SHIFT) {
+            fired++;
+            expires = hosttest_now + 50000000;
+        }
+        timer_run(hosttest_now);
+        CHECK(hosttest_fired == fired);
+        CHECK(hosttest_timer.pending);
+        CHECK(hosttest_timer.expires == expires);
+    }
+    CHECK(fired > 20);
+    CHECK(timer_cancel(&hosttest_timer) == 1);
+    CHECK(timer_next_tick() == TIMER_NONE);
+    return 0;
+}
+
+int main(void) {
+    int (*tests[])(void) = { test_atoi, test_scancodes, test_strings, test_lz4, test_fs, test_snap, test_editor, test_timer };
+    const char* names[] = { "atoi", "scancodes", "strings", "lz4", "fs", "snap", "editor", "timer" };
+
+    cpu_features_init();
+    cmd_buffer = kmalloc(CMD_BUFFER_SIZE);
+    for (unsigned int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (tests[i]()) {
+            print_string("[FAIL] ");
+            print_string(names[i]);
+            print_char('\n');
+            return 1;
+        }
+        print_string("[OK] ");
+        print_string(names[i]);
+        print_char('\n');
+    }
+    print_number(hosttest_checks);
+    print_string(" checks passed\n");
+    return 0;
+}
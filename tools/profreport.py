@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""Fold a VoxyOS `prof dump` into a top-N per-function report.
+
+Usage: tools/profreport.py kernel.sym capture.txt [top]
+
+capture.txt is any log containing the dump (e.g. the serial output of
+`make run-headless`); kernel.sym is written by `make` from kernel.elf.
+"""
+import bisect
+import re
+import sys
+
+
+def load_symbols(path):
+    symbols = []
+    with open(path) as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) == 3 and parts[1] in "tTwW":
+                symbols.append((int(parts[0], 16), parts[2]))
+    symbols.sort()
+    return symbols
+
+
+def load_samples(path):
+    samples = []
+    bucket = re.compile(r"^0x([0-9A-Fa-f]{8}) (\d+)$")
+    with open(path, errors="replace") as f:
+        for line in f:
+            m = bucket.match(line.strip())
+            if m:
+                samples.append((int(m.group(1), 16), int(m.group(2))))
+    return samples
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__.strip())
+    symbols = load_symbols(sys.argv[1])
+    samples = load_samples(sys.argv[2])
+    top = int(sys.argv[3]) if len(sys.argv) > 3 else 20
+    if not samples:
+        sys.exit("no prof dump lines found in " + sys.argv[2])
+
+    addrs = [a for a, _ in symbols]
+    totals = {}
+    for addr, count in samples:
+        i = bisect.bisect_right(addrs, addr) - 1
+        name = symbols[i][1] if i >= 0 else "?"
+        totals[name] = totals.get(name, 0) + count
+
+    total = sum(totals.values())
+    print("%8s %6s  %s" % ("samples", "%", "function"))
+    for name, count in sorted(totals.items(), key=lambda kv: -kv[1])[:top]:
+        print("%8d %5.1f%%  %s" % (count, 100.0 * count / total, name))
+    print("%8d total" % total)
+
+
+if __name__ == "__main__":
+    main()
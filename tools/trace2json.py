@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Convert a VoxyOS `trace dump` into Chrome trace JSON.
+
+Usage: tools/trace2json.py capture.txt > trace.json
+
+capture.txt is any log containing the dump (e.g. the serial output of
+`make run-headless`). Open the result in chrome://tracing or Perfetto.
+Spans become complete events and zero-length events become instants, one
+timeline row per CPU.
+"""
+import json
+import re
+import sys
+
+
+def load_events(path):
+    khz = None
+    events = []
+    header = re.compile(r"^trace: \d+ events, \d+ dropped, (\d+) kHz$")
+    line_re = re.compile(r"^(\d+) (\d+) (\d+) (\w+) (\d+)$")
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            m = header.match(line)
+            if m:
+                khz = int(m.group(1))
+                events = []
+                continue
+            m = line_re.match(line)
+            if m and khz:
+                start, cycles, cpu, name, arg = m.groups()
+                events.append((int(start), int(cycles), int(cpu), name, int(arg)))
+    return khz, events
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__.strip())
+    khz, events = load_events(sys.argv[1])
+    if not events:
+        sys.exit("no trace dump found in " + sys.argv[1])
+
+    # TSC cycles to microseconds, relative to the first event
+    base = min(start for start, _, _, _, _ in events)
+    scale = 1000.0 / khz
+    out = []
+    for start, cycles, cpu, name, arg in events:
+        event = {
+            "name": name,
+            "ts": (start - base) * scale,
+            "pid": 0,
+            "tid": cpu,
+            "args": {"arg": arg},
+        }
+        if cycles:
+            event["ph"] = "X"
+            event["dur"] = cycles * scale
+        else:
+            event["ph"] = "i"
+            event["s"] = "t"
+        out.append(event)
+    json.dump({"traceEvents": out, "displayTimeUnit": "ns"}, sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()